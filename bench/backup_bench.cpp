@@ -0,0 +1,328 @@
+// Throughput benchmarks for each backup stage and for whole backups and
+// restores. Built as the backup_bench target; the `bench` target runs it
+// and writes bench.json for regression tracking:
+//
+//   ./backup_bench --benchmark_filter=Backup --benchmark_out=run.json
+//                  --benchmark_out_format=json
+//
+// Everything runs in a scratch directory (BACKUP_BENCH_DIR or a fresh
+// one under /tmp), which is removed afterwards.
+#include "../main.cpp"
+
+#include <benchmark/benchmark.h>
+#include <map>
+#include <random>
+#include <tuple>
+
+namespace {
+
+const int64_t KiB = 1024;
+const int64_t MiB = 1024 * 1024;
+
+// `size` bytes in which `entropy_pct` percent of the 4KB blocks are
+// random and the rest log-like text (compresses about 4:1). The seed
+// keeps files distinct, so dedup does not hide work.
+std::vector<unsigned char> makeData(size_t size, int entropy_pct, uint64_t seed) {
+    std::vector<unsigned char> data(size);
+    std::mt19937_64 rng(seed);
+    const size_t block = 4 * KiB;
+    for (size_t start = 0; start < size; start += block) {
+        size_t end = std::min(size, start + block);
+        if (static_cast<int>(rng() % 100) < entropy_pct) {
+            for (size_t i = start; i < end; i += 8) {
+                uint64_t word = rng();
+                std::memcpy(&data[i], &word, std::min<size_t>(8, end - i));
+            }
+            continue;
+        }
+        size_t i = start;
+        while (i < end) {
+            char line[96];
+            int n = std::snprintf(line, sizeof line, "2026-10-14T12:%02u:%02u INFO id=%llu "
+                                  "path=/api/v1/items/%u status=200\n",
+                                  static_cast<unsigned>(rng() % 60), static_cast<unsigned>(rng() % 60),
+                                  static_cast<unsigned long long>(rng() % 100000000),
+                                  static_cast<unsigned>(rng() % 5000));
+            size_t take = std::min(end - i, static_cast<size_t>(n));
+            std::memcpy(&data[i], line, take);
+            i += take;
+        }
+    }
+    return data;
+}
+
+void writeFile(const std::string& path, const std::vector<unsigned char>& data) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+    if (!out) {
+        throw std::runtime_error("Cannot write " + path);
+    }
+}
+
+// Source files for one (file size, count, entropy) triple, written once
+// and reused by every benchmark that asks for the same set
+const std::vector<std::string>& sourceFiles(int64_t file_size, int64_t file_count, int entropy_pct) {
+    static std::map<std::tuple<int64_t, int64_t, int>, std::vector<std::string>> cache;
+    auto key = std::make_tuple(file_size, file_count, entropy_pct);
+    auto it = cache.find(key);
+    if (it != cache.end()) {
+        return it->second;
+    }
+    std::string dir = "src_" + std::to_string(file_size) + "_" + std::to_string(file_count) +
+                      "_" + std::to_string(entropy_pct);
+    fs::create_directories(dir);
+    std::vector<std::string> paths;
+    for (int64_t i = 0; i < file_count; ++i) {
+        paths.push_back(dir + "/f" + std::to_string(i));
+        writeFile(paths.back(), makeData(static_cast<size_t>(file_size), entropy_pct,
+                                         static_cast<uint64_t>(i) * 7919 + entropy_pct));
+    }
+    return cache.emplace(key, std::move(paths)).first->second;
+}
+
+// Removes the metadata and provider objects of a previous iteration
+void resetStore() {
+    std::error_code ec;
+    fs::remove_all("backup", ec);
+    for (const char* suffix : {"", "-wal", "-shm"}) {
+        fs::remove(std::string("bench.db") + suffix, ec);
+    }
+}
+
+PipelineConfig benchConfig(int64_t chunk_size, int64_t threads, int64_t latency_ms) {
+    PipelineConfig cfg;
+    cfg.log_level = LogLevel::Error; // pipeline logging would dominate small runs
+    cfg.max_chunk_size = static_cast<size_t>(chunk_size);
+    cfg.avg_chunk_size = std::max<size_t>(cfg.max_chunk_size / 4, 4 * KiB);
+    cfg.min_chunk_size = std::max<size_t>(cfg.max_chunk_size / 16, 2 * KiB);
+    cfg.encrypt_threads = static_cast<int>(threads);
+    cfg.pool_threads = static_cast<int>(threads);
+    cfg.restore_decrypt_threads = static_cast<int>(threads);
+    cfg.null_providers = latency_ms < 0;
+    cfg.provider_latency_ms = static_cast<int>(std::max<int64_t>(latency_ms, 0));
+    return cfg;
+}
+
+// --- Stages -------------------------------------------------------------
+
+// Args: cipher mode, chunk size
+void BM_Encrypt(benchmark::State& state) {
+    Encryption enc(static_cast<CipherMode>(state.range(0)));
+    std::vector<unsigned char> plain = makeData(static_cast<size_t>(state.range(1)), 100, 1);
+    std::vector<unsigned char> out(plain.size() + Encryption::overhead(enc.getMode()));
+    int64_t index = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(enc.encryptChunk(plain.data(), plain.size(), out.data(), 1, index++));
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(1));
+}
+BENCHMARK(BM_Encrypt)
+    ->ArgNames({"cipher", "bytes"})
+    ->ArgsProduct({{static_cast<int64_t>(CipherMode::AES_256_GCM), static_cast<int64_t>(CipherMode::AES_256_CBC)},
+                   {64 * KiB, MiB, 10 * MiB}});
+
+// Args: cipher mode, chunk size
+void BM_Decrypt(benchmark::State& state) {
+    Encryption enc(static_cast<CipherMode>(state.range(0)));
+    std::vector<unsigned char> plain = makeData(static_cast<size_t>(state.range(1)), 100, 2);
+    std::vector<unsigned char> cipher = enc.encryptChunk(plain, 1, 0);
+    std::vector<unsigned char> out(cipher.size());
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(enc.decryptChunk(cipher.data(), cipher.size(), out.data(), 1, 0));
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(1));
+}
+BENCHMARK(BM_Decrypt)
+    ->ArgNames({"cipher", "bytes"})
+    ->ArgsProduct({{static_cast<int64_t>(CipherMode::AES_256_GCM), static_cast<int64_t>(CipherMode::AES_256_CBC)},
+                   {64 * KiB, MiB, 10 * MiB}});
+
+// Args: checksum algorithm, chunk size
+void BM_Checksum(benchmark::State& state) {
+    std::unique_ptr<ChecksumEngine> hasher =
+        ChecksumEngine::create(static_cast<ChecksumAlgorithm>(state.range(0)));
+    std::vector<unsigned char> data = makeData(static_cast<size_t>(state.range(1)), 100, 3);
+    for (auto _ : state) {
+        hasher->reset();
+        hasher->update(data.data(), data.size());
+        benchmark::DoNotOptimize(hasher->digest());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(1));
+}
+BENCHMARK(BM_Checksum)
+    ->ArgNames({"algo", "bytes"})
+    ->ArgsProduct({{static_cast<int64_t>(ChecksumAlgorithm::Sha256), static_cast<int64_t>(ChecksumAlgorithm::XXH64)},
+                   {64 * KiB, MiB, 10 * MiB}});
+
+// Reads, cuts and hashes a 64MB file. Args: chunking mode, max chunk
+// size, entropy percent
+void BM_Chunking(benchmark::State& state) {
+    const int64_t file_size = 64 * MiB;
+    const std::string& path = sourceFiles(file_size, 1, static_cast<int>(state.range(2)))[0];
+    PipelineConfig cfg = benchConfig(state.range(1), 1, 0);
+    cfg.chunking = static_cast<ChunkingMode>(state.range(0));
+    cfg.drop_cache = false; // measure chunking, not the disk
+    BufferPool pool(cfg.buffer_count, cfg.huge_pages);
+    std::unique_ptr<ChecksumEngine> hasher = ChecksumEngine::create(cfg.checksum);
+    int64_t chunks = 0;
+    for (auto _ : state) {
+        std::unique_ptr<SourceReader> in = SourceReader::open(path, cfg, nullptr);
+        Chunker chunker(*in, cfg, pool, 0);
+        BufferPool::Handle data;
+        std::vector<unsigned char> checksum;
+        while (chunker.next(data, checksum, *hasher)) {
+            ++chunks;
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * file_size);
+    state.counters["chunks"] = benchmark::Counter(static_cast<double>(chunks), benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_Chunking)
+    ->ArgNames({"mode", "chunk", "entropy"})
+    ->ArgsProduct({{static_cast<int64_t>(ChunkingMode::Fixed), static_cast<int64_t>(ChunkingMode::ContentDefined)},
+                   {MiB, 10 * MiB},
+                   {0, 100}})
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+// Chunk rows committed through the metadata writer. Args: rows per iteration
+void BM_SqliteInsert(benchmark::State& state) {
+    resetStore();
+    DatabaseManager db("bench.db");
+    unsigned char key[32] = {0};
+    unsigned char iv[16] = {0};
+    FileStat st;
+    int file_id = db.insertFile("bench", st, 0, key, iv, static_cast<int>(CipherMode::AES_256_GCM));
+    ChunkRecord record;
+    record.file_id = file_id;
+    record.provider = "GoogleDrive";
+    record.checksum_algo = ChecksumAlgorithm::Sha256;
+    record.checksum.assign(32, 0);
+    record.chunk_size = record.stored_size = MiB;
+    int index = 0;
+    for (auto _ : state) {
+        for (int64_t i = 0; i < state.range(0); ++i, ++index) {
+            record.chunk_index = index;
+            std::memcpy(record.checksum.data(), &index, sizeof index); // distinct content keys
+            record.remote_path = "file_" + std::to_string(file_id) + "_chunk_" + std::to_string(index) + ".enc";
+            db.insertChunk(record, true);
+        }
+        db.flush();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+// Rows commit on the writer thread, so wall time is what counts
+BENCHMARK(BM_SqliteInsert)->ArgNames({"rows"})->Arg(1000)->Arg(10000)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+// --- End to end ---------------------------------------------------------
+
+// Args: file size, file count, max chunk size, encrypt threads, entropy
+// percent, provider latency in ms (-1 = null provider)
+void BM_Backup(benchmark::State& state) {
+    const std::vector<std::string>& files =
+        sourceFiles(state.range(0), state.range(1), static_cast<int>(state.range(4)));
+    PipelineConfig cfg = benchConfig(state.range(2), state.range(3), state.range(5));
+    for (auto _ : state) {
+        state.PauseTiming();
+        resetStore();
+        state.ResumeTiming();
+        BackupSystem sys("bench.db", cfg);
+        std::vector<std::shared_ptr<BackupHandle>> handles;
+        for (const auto& path : files) {
+            handles.push_back(sys.submitFile(path));
+        }
+        for (auto& handle : handles) {
+            handle->wait();
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0) * state.range(1));
+    state.SetItemsProcessed(state.iterations() * state.range(1));
+}
+
+// One baseline (64MB file, 10MB chunks, 4 threads, mixed data, null
+// provider), then each dimension varied on its own
+void backupSweeps(benchmark::internal::Benchmark* b) {
+    const std::vector<int64_t> base = {64 * MiB, 1, 10 * MiB, 4, 50, -1};
+    b->ArgNames({"file", "files", "chunk", "threads", "entropy", "latency"});
+    b->Args(base);
+    auto vary = [&](size_t dim, std::vector<int64_t> values) {
+        for (int64_t v : values) {
+            std::vector<int64_t> args = base;
+            args[dim] = v;
+            // Keep the total near the baseline when shrinking files
+            if (dim == 0) {
+                args[1] = std::max<int64_t>(1, base[0] / v);
+            }
+            b->Args(args);
+        }
+    };
+    vary(0, {64 * KiB, MiB, 256 * MiB});
+    vary(1, {4, 16});
+    vary(2, {MiB, 4 * MiB});
+    vary(3, {1, 2, 8});
+    vary(4, {0, 100});
+    vary(5, {0, 20, 100});
+}
+BENCHMARK(BM_Backup)->Apply(backupSweeps)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+// Restores one backed-up file. Args: file size, max chunk size, decrypt
+// threads, entropy percent
+void BM_Restore(benchmark::State& state) {
+    const std::string& path = sourceFiles(state.range(0), 1, static_cast<int>(state.range(3)))[0];
+    PipelineConfig cfg = benchConfig(state.range(1), state.range(2), 0);
+    resetStore();
+    BackupSystem sys("bench.db", cfg);
+    int file_id = sys.backupFile(path);
+    for (auto _ : state) {
+        sys.restoreFile(file_id, "restored.bin");
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Restore)
+    ->ArgNames({"file", "chunk", "threads", "entropy"})
+    ->Args({64 * MiB, 10 * MiB, 4, 50})
+    ->Args({64 * MiB, MiB, 4, 50})
+    ->Args({64 * MiB, 10 * MiB, 1, 50})
+    ->Args({64 * MiB, 10 * MiB, 8, 50})
+    ->Args({64 * MiB, 10 * MiB, 4, 0})
+    ->Args({64 * MiB, 10 * MiB, 4, 100})
+    ->Args({256 * MiB, 10 * MiB, 4, 50})
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
+} // namespace
+
+int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+
+    const char* requested = std::getenv("BACKUP_BENCH_DIR");
+    std::string scratch;
+    if (requested) {
+        scratch = requested;
+        fs::create_directories(scratch);
+    } else {
+        char pattern[] = "/tmp/backup_bench.XXXXXX";
+        if (!mkdtemp(pattern)) {
+            std::cerr << "Cannot create a scratch directory" << std::endl;
+            return 1;
+        }
+        scratch = pattern;
+    }
+    fs::path original = fs::current_path();
+    fs::current_path(scratch);
+
+    benchmark::AddCustomContext("chunk_buffers", std::to_string(CHUNK_BUFFER_COUNT));
+    benchmark::AddCustomContext("scratch_dir", scratch);
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    fs::current_path(original);
+    if (!requested) {
+        std::error_code ec;
+        fs::remove_all(scratch, ec);
+    }
+    return 0;
+}
@@ -0,0 +1,981 @@
+// Unit tests of the pipeline's building blocks and end-to-end tests of
+// the backup system, including its failure paths. Built as the
+// backup_tests target; ctest runs each test on its own, as
+// `backup_tests <name>`:
+//
+//   ctest --output-on-failure -R Backup
+//
+// Each test runs in a fresh scratch directory under /tmp, removed
+// afterwards.
+#include "../main.cpp"
+
+#include <map>
+#include <random>
+#include <set>
+
+namespace {
+
+// A failed CHECK ends its test; not a runtime_error, so CHECK_THROWS
+// never mistakes one for the error it expects
+struct TestFailure : std::logic_error {
+    using std::logic_error::logic_error;
+};
+
+struct TestCase {
+    const char* name;
+    void (*run)();
+};
+
+std::vector<TestCase>& testCases() {
+    static std::vector<TestCase> cases;
+    return cases;
+}
+
+struct TestRegistrar {
+    TestRegistrar(const char* name, void (*run)()) { testCases().push_back(TestCase{name, run}); }
+};
+
+std::string failure(const char* file, int line, const std::string& what) {
+    return std::string(file) + ":" + std::to_string(line) + ": " + what;
+}
+
+// CMakeLists.txt finds the tests by this macro at the start of a line
+#define TEST(name)                                         \
+    void name();                                           \
+    const TestRegistrar name##_registrar(#name, name);     \
+    void name()
+
+#define CHECK(condition)                                                          \
+    do {                                                                          \
+        if (!(condition)) {                                                       \
+            throw TestFailure(failure(__FILE__, __LINE__, "CHECK(" #condition ")")); \
+        }                                                                         \
+    } while (0)
+
+#define CHECK_EQ(actual, expected)                                                        \
+    do {                                                                                  \
+        auto actual_value = (actual);                                                     \
+        auto expected_value = (expected);                                                 \
+        if (!(actual_value == expected_value)) {                                          \
+            std::ostringstream message;                                                   \
+            message << #actual " is " << actual_value << ", expected " << expected_value; \
+            throw TestFailure(failure(__FILE__, __LINE__, message.str()));                \
+        }                                                                                 \
+    } while (0)
+
+#define CHECK_THROWS(statement)                                                              \
+    do {                                                                                     \
+        bool threw = false;                                                                  \
+        try {                                                                                \
+            statement;                                                                       \
+        } catch (const std::runtime_error&) {                                                \
+            threw = true;                                                                    \
+        }                                                                                    \
+        if (!threw) {                                                                        \
+            throw TestFailure(failure(__FILE__, __LINE__, #statement " did not throw"));     \
+        }                                                                                    \
+    } while (0)
+
+const size_t KiB = 1024;
+const size_t MiB = 1024 * 1024;
+
+std::vector<unsigned char> randomBytes(size_t size, uint64_t seed) {
+    std::vector<unsigned char> data(size);
+    std::mt19937_64 rng(seed);
+    for (size_t i = 0; i < size; i += 8) {
+        uint64_t word = rng();
+        std::memcpy(&data[i], &word, std::min<size_t>(8, size - i));
+    }
+    return data;
+}
+
+void writeFile(const std::string& path, const std::vector<unsigned char>& data) {
+    fs::path parent = fs::path(path).parent_path();
+    if (!parent.empty()) {
+        fs::create_directories(parent);
+    }
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+}
+
+void writeFile(const std::string& path, const std::string& text) {
+    writeFile(path, std::vector<unsigned char>(text.begin(), text.end()));
+}
+
+std::vector<unsigned char> readFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::vector<unsigned char>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+// Stored objects below the providers' directories whose name contains part
+std::vector<fs::path> storedObjects(const std::string& part) {
+    std::vector<fs::path> found;
+    if (!fs::exists("backup")) {
+        return found;
+    }
+    for (const auto& entry : fs::recursive_directory_iterator("backup")) {
+        if (entry.is_regular_file() && entry.path().filename().string().find(part) != std::string::npos) {
+            found.push_back(entry.path());
+        }
+    }
+    return found;
+}
+
+void execSql(const std::string& db_path, const std::string& sql) {
+    sqlite3* db = nullptr;
+    CHECK_EQ(sqlite3_open(db_path.c_str(), &db), SQLITE_OK);
+    char* error = nullptr;
+    int rc = sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &error);
+    std::string message = error ? error : "";
+    sqlite3_free(error);
+    sqlite3_close(db);
+    CHECK_EQ(message, std::string());
+    CHECK_EQ(rc, SQLITE_OK);
+}
+
+// First column of the first row of a query, as an integer
+int64_t queryInt(const std::string& db_path, const std::string& sql) {
+    sqlite3* db = nullptr;
+    CHECK_EQ(sqlite3_open(db_path.c_str(), &db), SQLITE_OK);
+    sqlite3_stmt* stmt = nullptr;
+    CHECK_EQ(sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr), SQLITE_OK);
+    bool found = sqlite3_step(stmt) == SQLITE_ROW;
+    int64_t value = found ? sqlite3_column_int64(stmt, 0) : 0;
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    CHECK(found);
+    return value;
+}
+
+// Small chunks and a fast simulated network keep each run short
+PipelineConfig testConfig() {
+    PipelineConfig cfg;
+    cfg.log_level = LogLevel::Error;
+    cfg.provider_latency_ms = 1;
+    cfg.min_chunk_size = 64 * KiB;
+    cfg.avg_chunk_size = 256 * KiB;
+    cfg.max_chunk_size = 1 * MiB;
+    return cfg;
+}
+
+// Cut offsets of a file, as the backup pipeline would chunk it; ring
+// serves ReaderBackend::Uring
+std::vector<uint64_t> cutPoints(const std::string& path, const PipelineConfig& cfg, IoRing* ring = nullptr) {
+    BufferPool pool(cfg.buffer_count, false);
+    std::unique_ptr<ChecksumEngine> hasher = ChecksumEngine::create(cfg.checksum);
+    std::unique_ptr<SourceReader> in = SourceReader::open(path, cfg, ring);
+    Chunker chunker(*in, cfg, pool, 0);
+    BufferPool::Handle data;
+    std::vector<unsigned char> checksum;
+    std::vector<uint64_t> cuts;
+    while (chunker.next(data, checksum, *hasher)) {
+        cuts.push_back(chunker.position());
+    }
+    return cuts;
+}
+
+std::string xxh64Hex(const std::string& text) {
+    XXH64Checksum hasher;
+    hasher.reset();
+    hasher.update(reinterpret_cast<const unsigned char*>(text.data()), text.size());
+    std::vector<unsigned char> digest = hasher.digest();
+    return toHex(digest.data(), digest.size());
+}
+
+// --- Building blocks ---
+
+TEST(ReedSolomonRebuildsFromAnyKShards) {
+    const int k = 4;
+    const int m = 2;
+    const size_t len = 1000;
+    ReedSolomon code(k, m);
+    std::vector<unsigned char> data = randomBytes(k * len, 1);
+    std::vector<unsigned char> parity(m * len);
+    std::vector<const unsigned char*> data_ptrs;
+    std::vector<unsigned char*> parity_ptrs;
+    for (int i = 0; i < k; ++i) {
+        data_ptrs.push_back(data.data() + i * len);
+    }
+    for (int i = 0; i < m; ++i) {
+        parity_ptrs.push_back(parity.data() + i * len);
+    }
+    code.encode(data_ptrs.data(), parity_ptrs.data(), len);
+
+    // Every choice of k surviving shards out of k + m
+    for (int mask = 0; mask < (1 << (k + m)); ++mask) {
+        if (__builtin_popcount(mask) != k) {
+            continue;
+        }
+        std::vector<std::pair<int, const unsigned char*>> shards;
+        for (int i = 0; i < k + m; ++i) {
+            if (mask & (1 << i)) {
+                shards.emplace_back(i, i < k ? data_ptrs[i] : parity_ptrs[i - k]);
+            }
+        }
+        std::vector<unsigned char> out(k * len);
+        code.decode(shards, out.data(), len);
+        CHECK(out == data);
+    }
+}
+
+TEST(ReedSolomonNeedsKDistinctShards) {
+    ReedSolomon code(4, 2);
+    std::vector<unsigned char> shard(16), out(64);
+    std::vector<std::pair<int, const unsigned char*>> three = {{0, shard.data()}, {1, shard.data()}, {4, shard.data()}};
+    CHECK_THROWS(code.decode(three, out.data(), shard.size()));
+    std::vector<std::pair<int, const unsigned char*>> repeated = {
+        {0, shard.data()}, {0, shard.data()}, {1, shard.data()}, {2, shard.data()}};
+    CHECK_THROWS(code.decode(repeated, out.data(), shard.size()));
+}
+
+TEST(XXH64MatchesReferenceVectors) {
+    CHECK_EQ(xxh64Hex(""), std::string("ef46db3751d8e999"));
+    CHECK_EQ(xxh64Hex("a"), std::string("d24ec4f1a98c6e5b"));
+    CHECK_EQ(xxh64Hex("abc"), std::string("44bc2cf5ad770999"));
+    CHECK_EQ(xxh64Hex("Nobody inspects the spammish repetition"), std::string("fbcea83c8a378bf1"));
+}
+
+TEST(XXH64SplitUpdatesMatchOneShot) {
+    std::vector<unsigned char> data = randomBytes(1000, 2);
+    XXH64Checksum whole;
+    whole.reset();
+    whole.update(data.data(), data.size());
+    std::vector<unsigned char> expected = whole.digest();
+    for (size_t split : {size_t(1), size_t(31), size_t(32), size_t(33), size_t(500), size_t(999)}) {
+        XXH64Checksum parts;
+        parts.reset();
+        parts.update(data.data(), split);
+        parts.update(data.data() + split, data.size() - split);
+        CHECK(parts.digest() == expected);
+    }
+}
+
+TEST(FairQueueSharesByWeight) {
+    FairQueue<int> queue(64);
+    for (int i = 0; i < 40; ++i) {
+        CHECK(queue.push(1, 1, 1));
+        CHECK(queue.push(2, 3, 2));
+    }
+    int heavy = 0;
+    for (int i = 0; i < 20; ++i) {
+        int flow = 0;
+        CHECK(queue.tryPop(flow));
+        heavy += flow == 2;
+    }
+    CHECK(heavy >= 14 && heavy <= 16); // weight 3 against 1
+    CHECK_EQ(queue.size(), size_t(60));
+}
+
+TEST(FairQueueIdleFlowBanksNoCredit) {
+    FairQueue<int> queue(64);
+    int item = 0;
+    for (int i = 0; i < 10; ++i) {
+        CHECK(queue.push(1, 1, 1));
+    }
+    for (int i = 0; i < 10; ++i) {
+        CHECK(queue.tryPop(item));
+    }
+    // Flow 2 arrives late: it alternates with flow 1 rather than catching up
+    for (int i = 0; i < 10; ++i) {
+        CHECK(queue.push(1, 1, 1));
+        CHECK(queue.push(2, 1, 2));
+    }
+    int late = 0;
+    for (int i = 0; i < 6; ++i) {
+        CHECK(queue.tryPop(item));
+        late += item == 2;
+    }
+    CHECK_EQ(late, 3);
+    queue.close();
+    CHECK(!queue.push(1, 1, 1));
+    CHECK(queue.tryPop(item)); // closing keeps what is queued
+}
+
+TEST(ConfigParsesSizes) {
+    CHECK_EQ(parseSize("4096"), uint64_t(4096));
+    CHECK_EQ(parseSize("4K"), uint64_t(4096));
+    CHECK_EQ(parseSize("64KB"), uint64_t(64 * KiB));
+    CHECK_EQ(parseSize("2MiB"), uint64_t(2 * MiB));
+    CHECK_EQ(parseSize("1g"), uint64_t(1024 * MiB));
+    CHECK_THROWS(parseSize(""));
+    CHECK_THROWS(parseSize("-1"));
+    CHECK_THROWS(parseSize("4X"));
+    CHECK_THROWS(parseSize("99999999999999999999"));
+    CHECK_THROWS(parseSize("18446744073709551615K"));
+}
+
+TEST(ConfigSetsAndValidatesOptions) {
+    PipelineConfig cfg;
+    setConfigOption(cfg, "part_size", "1M");
+    CHECK_EQ(cfg.part_size, size_t(1 * MiB));
+    setConfigOption(cfg, "provider.Dropbox.cost_weight", "2.5");
+    CHECK_EQ(providerOption(cfg, "Dropbox").cost_weight, 2.5);
+    validateConfig(cfg);
+
+    CHECK_THROWS(setConfigOption(cfg, "no_such_option", "1"));
+    CHECK_THROWS(setConfigOption(cfg, "provider.Dropbox.cost_weight", "2.5x"));
+    CHECK_THROWS(setConfigOption(cfg, "upload_attempts", "three"));
+
+    PipelineConfig sizes;
+    sizes.min_chunk_size = 8 * MiB; // above the average
+    CHECK_THROWS(validateConfig(sizes));
+
+    PipelineConfig attempts;
+    setConfigOption(attempts, "part_attempts", "0");
+    CHECK_THROWS(validateConfig(attempts));
+
+    PipelineConfig shards;
+    shards.distribution = DistributionMode::ErasureCoded;
+    shards.ec_data_shards = 3;
+    shards.ec_parity_shards = 1; // four shards, three providers
+    CHECK_THROWS(validateConfig(shards));
+}
+
+TEST(InvalidConfigFailsBeforeTheSystemStarts) {
+    PipelineConfig cfg = testConfig();
+    cfg.buffer_count = 0;
+    cfg.queue_depth = 0;
+    std::string message;
+    try {
+        BackupSystem backup("backup.db", cfg);
+    } catch (const std::runtime_error& e) {
+        message = e.what();
+    }
+    CHECK_EQ(message.rfind("Invalid configuration", 0), size_t(0));
+    CHECK(!fs::exists("backup.db"));
+}
+
+TEST(WorkStealingPoolRunsEveryTaskIncludingNested) {
+    WorkStealingPool pool(4, false);
+    std::atomic<int> ran{0};
+    for (int i = 0; i < 500; ++i) {
+        pool.submit([&pool, &ran] {
+            ++ran;
+            pool.submit([&ran] { ++ran; });
+        });
+    }
+    pool.wait();
+    CHECK_EQ(ran.load(), 1000);
+}
+
+TEST(TaskGroupCapsUnfinishedTasks) {
+    WorkStealingPool pool(4, false);
+    TaskGroup group(pool, 2);
+    std::atomic<int> running{0};
+    std::atomic<int> peak{0};
+    std::atomic<int> ran{0};
+    for (int i = 0; i < 20; ++i) {
+        group.run([&] {
+            int now = ++running;
+            int seen = peak.load();
+            while (now > seen && !peak.compare_exchange_weak(seen, now)) {
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            --running;
+            ++ran;
+        });
+    }
+    group.wait();
+    CHECK_EQ(ran.load(), 20);
+    CHECK(peak.load() <= 2);
+    CHECK_EQ(group.size(), size_t(0));
+}
+
+// --- Chunking ---
+
+TEST(ChunkerCutsSurviveAnInsertion) {
+    PipelineConfig cfg = testConfig();
+    cfg.chunking = ChunkingMode::ContentDefined;
+    cfg.drop_cache = false;
+    const size_t edit = 1 * MiB;
+    const size_t inserted = 100;
+    std::vector<unsigned char> original = randomBytes(8 * MiB, 3);
+    std::vector<unsigned char> edited(original.begin(), original.begin() + edit);
+    std::vector<unsigned char> extra = randomBytes(inserted, 4);
+    edited.insert(edited.end(), extra.begin(), extra.end());
+    edited.insert(edited.end(), original.begin() + edit, original.end());
+    writeFile("original.bin", original);
+    writeFile("edited.bin", edited);
+
+    std::vector<uint64_t> before = cutPoints("original.bin", cfg);
+    std::vector<uint64_t> after = cutPoints("edited.bin", cfg);
+    CHECK(before.size() > 8);
+    CHECK_EQ(before.back(), uint64_t(original.size()));
+    CHECK_EQ(after.back(), uint64_t(edited.size()));
+
+    // Cuts before the edit stay put; past the next maximum-size chunk
+    // they all move by the inserted length
+    std::set<uint64_t> moved(after.begin(), after.end());
+    size_t kept = 0;
+    size_t checked = 0;
+    for (uint64_t cut : before) {
+        if (cut < edit) {
+            CHECK(moved.count(cut));
+        } else if (cut > edit + cfg.max_chunk_size) {
+            ++checked;
+            kept += moved.count(cut + inserted);
+        }
+    }
+    CHECK(checked > 0);
+    CHECK_EQ(kept, checked);
+}
+
+// A reader must hand the chunker the buffered reader's bytes: the same
+// cuts, and backups through it restore exactly. The large file's tail is
+// not block aligned, and the small one is shorter than a block.
+void checkReaderMatchesBuffered(ReaderBackend reader) {
+    PipelineConfig cfg = testConfig();
+    std::vector<unsigned char> large = randomBytes(5 * MiB + 777, 30);
+    std::vector<unsigned char> small = randomBytes(100, 31);
+    writeFile("src/large.bin", large);
+    writeFile("src/small.bin", small);
+    std::vector<uint64_t> buffered = cutPoints("src/large.bin", cfg);
+    cfg.reader = reader;
+    std::unique_ptr<IoRing> ring = reader == ReaderBackend::Uring
+        ? IoRing::create(IO_RING_ENTRIES, IO_RING_FIXED_BUFFERS) : nullptr;
+    CHECK(cutPoints("src/large.bin", cfg, ring.get()) == buffered);
+    BackupSystem backup("backup.db", cfg);
+    int large_id = backup.backupFile("src/large.bin");
+    int small_id = backup.backupFile("src/small.bin");
+    backup.restoreFile(large_id, "out/large.bin");
+    backup.restoreFile(small_id, "out/small.bin");
+    CHECK(readFile("out/large.bin") == large);
+    CHECK(readFile("out/small.bin") == small);
+}
+
+TEST(MmapReaderMatchesBufferedReads) {
+    checkReaderMatchesBuffered(ReaderBackend::Mmap);
+}
+
+TEST(DirectReaderMatchesBufferedReads) {
+    checkReaderMatchesBuffered(ReaderBackend::Direct);
+}
+
+TEST(UringReaderMatchesBufferedReads) {
+    checkReaderMatchesBuffered(ReaderBackend::Uring);
+}
+
+// --- Backup, restore and the catalog ---
+
+TEST(BackupRestoresWhatWasBackedUp) {
+    PipelineConfig cfg = testConfig();
+    std::vector<unsigned char> data = randomBytes(3 * MiB + 123, 5);
+    writeFile("src/a.bin", data);
+    writeFile("src/empty.bin", std::string());
+    BackupSystem backup("backup.db", cfg);
+    int a = backup.backupFile("src/a.bin");
+    int empty = backup.backupFile("src/empty.bin");
+    backup.restoreFile(a, "out/a.bin");
+    backup.restoreFile(empty, "out/empty.bin");
+    CHECK(readFile("out/a.bin") == data);
+    CHECK(fs::exists("out/empty.bin"));
+    CHECK_EQ(fs::file_size("out/empty.bin"), uintmax_t(0));
+}
+
+TEST(PackedSmallFilesRestoreFromTheirContainer) {
+    PipelineConfig cfg = testConfig();
+    std::vector<std::vector<unsigned char>> small;
+    for (int i = 0; i < 20; ++i) {
+        small.push_back(randomBytes((i + 1) * KiB + 17, 100 + i));
+        writeFile("tree/f" + std::to_string(i) + ".bin", small.back());
+    }
+    std::vector<unsigned char> large = randomBytes(1 * MiB, 99);
+    writeFile("tree/large.bin", large);
+    BackupSystem backup("backup.db", cfg);
+    CHECK_EQ(backup.backupDirectory("tree"), 21);
+
+    // One object holds every small file; the large one has its own
+    CHECK_EQ(storedObjects(".pack").size(), size_t(1));
+    CHECK_EQ(queryInt("backup.db", "SELECT COUNT(*) FROM chunks WHERE container_id IS NOT NULL"), int64_t(20));
+    CHECK_EQ(queryInt("backup.db", "SELECT COUNT(*) FROM chunks WHERE container_id IS NULL"),
+             queryInt("backup.db", "SELECT chunk_count FROM files WHERE original_path LIKE '%large.bin'"));
+    for (int i : {0, 7, 19}) {
+        std::string name = "f" + std::to_string(i) + ".bin";
+        int file_id = static_cast<int>(
+            queryInt("backup.db", "SELECT file_id FROM files WHERE original_path LIKE '%/" + name + "'"));
+        backup.restoreFile(file_id, "out/" + name);
+        CHECK(readFile("out/" + name) == small[i]);
+    }
+}
+
+TEST(RestoreDirectoryRebuildsTheTreeAsOfASnapshot) {
+    PipelineConfig cfg = testConfig();
+    std::vector<unsigned char> a = randomBytes(3 * MiB + 5, 20);
+    std::vector<unsigned char> c = randomBytes(700 * KiB, 21);
+    writeFile("tree/a.bin", a);
+    writeFile("tree/sub/b.txt", "first version");
+    writeFile("tree/sub/deeper/c.bin", c);
+    BackupSystem backup("backup.db", cfg);
+    backup.backupDirectory("tree");
+    int first = backup.listSnapshots().back().snapshot_id;
+    writeFile("tree/sub/b.txt", "second version");
+    backup.backupDirectory("tree");
+
+    CHECK_EQ(backup.restoreDirectory("tree", "latest"), 3);
+    CHECK(readFile("latest/a.bin") == a);
+    CHECK(readFile("latest/sub/b.txt") == readFile("tree/sub/b.txt"));
+    CHECK(readFile("latest/sub/deeper/c.bin") == c);
+
+    CHECK_EQ(backup.restoreDirectory("tree", "older", first), 3);
+    std::vector<unsigned char> old_b = readFile("older/sub/b.txt");
+    CHECK_EQ(std::string(old_b.begin(), old_b.end()), std::string("first version"));
+    CHECK(readFile("older/sub/deeper/c.bin") == c);
+}
+
+TEST(CatalogDiffsAndKeepsFilesTheGlobsSkip) {
+    PipelineConfig cfg = testConfig();
+    writeFile("tree/a.txt", "a");
+    writeFile("tree/b.log", "b");
+    writeFile("tree/skip/c.txt", "c");
+    writeFile("tree/other/d.txt", "d");
+    BackupSystem backup("backup.db", cfg);
+    backup.backupDirectory("tree");
+
+    WalkOptions globs;
+    globs.exclude = {"*.log", "skip"};
+    backup.backupDirectory("tree", BackupMode::Incremental, globs);
+    std::set<std::string> names;
+    for (const auto& entry : backup.listDirectory(2, "tree")) {
+        names.insert(entry.name);
+    }
+    CHECK(names == (std::set<std::string>{"a.txt", "b.log", "other", "skip"}));
+
+    fs::remove("tree/a.txt");
+    writeFile("tree/other/d.txt", "d, second version");
+    backup.backupDirectory("tree", BackupMode::Incremental);
+
+    std::vector<SnapshotRecord> snapshots = backup.listSnapshots();
+    CHECK_EQ(snapshots.size(), size_t(3));
+    for (const auto& snapshot : snapshots) {
+        CHECK_EQ(snapshot.status, std::string("completed"));
+    }
+
+    std::map<std::string, SnapshotChange> changes;
+    for (const auto& change : backup.diffSnapshots(2, 3)) {
+        changes[change.path] = change;
+    }
+    CHECK_EQ(changes.size(), size_t(2));
+    CHECK_EQ(changes["tree/a.txt"].new_file_id, 0); // deleted
+    CHECK(changes["tree/other/d.txt"].old_file_id != 0);
+    CHECK(changes["tree/other/d.txt"].new_file_id != 0);
+
+    // Below a root only, which is a directory and not a name prefix
+    std::vector<SnapshotChange> other = backup.diffSnapshots(3, 2, "tree/other");
+    CHECK_EQ(other.size(), size_t(1));
+    CHECK_EQ(other[0].path, std::string("tree/other/d.txt"));
+    CHECK_EQ(other[0].old_file_id, changes["tree/other/d.txt"].new_file_id);
+    CHECK(backup.diffSnapshots(2, 3, "tree/oth").empty());
+    CHECK_EQ(backup.diffSnapshots(2, 3, "tree/a.txt").size(), size_t(1));
+}
+
+TEST(ResumeFinishesAFailedBackup) {
+    PipelineConfig cfg = testConfig();
+    cfg.upload_attempts = 1;
+    cfg.upload_hedging = false;
+    cfg.providers = {ProviderConfig{"Only", "./backup/only"}};
+    std::vector<unsigned char> data = randomBytes(2 * MiB, 6);
+    writeFile("src/a.bin", data);
+    int file_id = 0;
+    {
+        BackupSystem backup("backup.db", cfg);
+        // The provider's directory is replaced by a file, so every upload fails
+        fs::remove_all("backup/only");
+        writeFile("backup/only", "not a directory");
+        std::shared_ptr<BackupHandle> handle = backup.submitFile("src/a.bin");
+        CHECK_THROWS(handle->wait());
+        file_id = handle->fileId();
+    }
+    CHECK(file_id != 0);
+    fs::remove("backup/only");
+    BackupSystem backup("backup.db", cfg);
+    CHECK_EQ(backup.resumeBackup(file_id), file_id);
+    backup.restoreFile(file_id, "out/a.bin");
+    CHECK(readFile("out/a.bin") == data);
+}
+
+// Turns a completed backup into one interrupted after each chunk's first
+// part: the chunk rows become part acks and each object is cut back to a
+// .partial holding that part. Returns the objects as they were.
+std::map<fs::path, std::vector<unsigned char>> keepFirstParts(size_t part_size) {
+    execSql("backup.db", R"(
+        INSERT INTO upload_parts (file_id, chunk_index, part_index, part_offset, cloud_provider,
+                                  remote_path, checksum, stored_size, codec, compressed_size,
+                                  compressed_checksum)
+        SELECT file_id, chunk_index, 0, 0, cloud_provider, remote_path, checksum, stored_size,
+               codec, compressed_size, compressed_checksum FROM chunks;
+        DELETE FROM chunks;
+        DELETE FROM content_index;
+        UPDATE files SET status = 'failed';
+    )");
+    std::map<fs::path, std::vector<unsigned char>> objects;
+    for (const fs::path& object : storedObjects("_chunk_")) {
+        std::vector<unsigned char> data = readFile(object.string());
+        CHECK(data.size() > part_size);
+        objects[object] = data;
+        fs::remove(object);
+        writeFile(object.string() + ".partial", std::vector<unsigned char>(data.begin(), data.begin() + part_size));
+    }
+    CHECK(!objects.empty());
+    return objects;
+}
+
+std::string compressibleText() {
+    std::string text;
+    for (int i = 0; i < 40000; ++i) {
+        text += "line " + std::to_string(i * 7919 % 100003) + " of compressible text\n";
+    }
+    return text;
+}
+
+TEST(ResumeEncryptsPartlyUploadedChunksFromTheirRecordedForm) {
+    // The resumed run compresses harder; a chunk whose first part went out
+    // must still be encrypted from the bytes that part was cut from
+    PipelineConfig cfg = testConfig();
+    cfg.upload_hedging = false;
+    cfg.part_size = 4 * KiB;
+    cfg.compression_level = 1;
+    cfg.providers = {ProviderConfig{"Only", "./backup/only"}};
+    std::string text = compressibleText();
+    writeFile("src/text.txt", text);
+    int file_id = 0;
+    {
+        BackupSystem backup("backup.db", cfg);
+        file_id = backup.backupFile("src/text.txt");
+    }
+    std::map<fs::path, std::vector<unsigned char>> objects = keepFirstParts(cfg.part_size);
+    cfg.compression_level = 9;
+    BackupSystem backup("backup.db", cfg);
+    CHECK_EQ(backup.resumeBackup(file_id), file_id);
+    for (const auto& object : objects) {
+        CHECK(readFile(object.first.string()) == object.second);
+    }
+    backup.restoreFile(file_id, "out/text.txt");
+    CHECK(readFile("out/text.txt") == std::vector<unsigned char>(text.begin(), text.end()));
+}
+
+TEST(ResumeStartsOverWhenAPartlyUploadedChunkCannotBeReproduced) {
+    // Parts acknowledged before their compressed form was recorded
+    PipelineConfig cfg = testConfig();
+    cfg.upload_hedging = false;
+    cfg.part_size = 4 * KiB;
+    cfg.providers = {ProviderConfig{"Only", "./backup/only"}};
+    std::string text = compressibleText();
+    writeFile("src/text.txt", text);
+    int file_id = 0;
+    {
+        BackupSystem backup("backup.db", cfg);
+        file_id = backup.backupFile("src/text.txt");
+    }
+    keepFirstParts(cfg.part_size);
+    execSql("backup.db", "UPDATE upload_parts SET codec = NULL, compressed_checksum = NULL");
+    int restarted = 0;
+    {
+        BackupSystem backup("backup.db", cfg);
+        restarted = backup.resumeBackup(file_id);
+        CHECK(restarted != file_id);
+        backup.restoreFile(restarted, "out/text.txt");
+    }
+    CHECK(readFile("out/text.txt") == std::vector<unsigned char>(text.begin(), text.end()));
+    CHECK(storedObjects(".partial").empty());
+    CHECK_EQ(queryInt("backup.db", "SELECT COUNT(*) FROM upload_parts"), int64_t(0));
+    std::string status = "SELECT status = 'failed' FROM files WHERE file_id = " + std::to_string(file_id);
+    CHECK_EQ(queryInt("backup.db", status), int64_t(1));
+}
+
+TEST(StreamedBackupsCannotBeResumed) {
+    PipelineConfig cfg = testConfig();
+    writeFile("src/a.bin", randomBytes(512 * KiB, 13));
+    int file_id = 0;
+    {
+        BackupSystem backup("backup.db", cfg);
+        int fd = ::open("src/a.bin", O_RDONLY);
+        CHECK(fd >= 0);
+        file_id = backup.backupStream(fd, "dump.bin");
+        ::close(fd);
+        backup.backupFile("src/a.bin");
+    }
+    std::string streamed = "SELECT streamed FROM files WHERE file_id = " + std::to_string(file_id);
+    CHECK_EQ(queryInt("backup.db", streamed), int64_t(1));
+    CHECK_EQ(queryInt("backup.db", "SELECT SUM(streamed) FROM files"), int64_t(1));
+    execSql("backup.db", "UPDATE files SET status = 'failed'");
+    {
+        BackupSystem backup("backup.db", cfg);
+        CHECK_THROWS(backup.resumeBackup(file_id));
+    }
+    // Catalogs from before the streamed column are migrated from the inode
+    execSql("backup.db", "ALTER TABLE files DROP COLUMN streamed");
+    { BackupSystem backup("backup.db", cfg); }
+    CHECK_EQ(queryInt("backup.db", streamed), int64_t(1));
+    CHECK_EQ(queryInt("backup.db", "SELECT SUM(streamed) FROM files"), int64_t(1));
+}
+
+TEST(ScrubRebuildsALostChunk) {
+    PipelineConfig cfg = testConfig();
+    std::string text;
+    for (int i = 0; i < 40000; ++i) {
+        text += "line " + std::to_string(i % 977) + " of compressible text\n";
+    }
+    writeFile("src/text.txt", text);
+    int file_id = 0;
+    {
+        BackupSystem backup("backup.db", cfg);
+        file_id = backup.backupFile("src/text.txt");
+    }
+    std::vector<fs::path> objects = storedObjects("chunk_0");
+    CHECK(!objects.empty());
+    fs::remove(objects[0]);
+    {
+        BackupSystem backup("backup.db", cfg);
+        ScrubReport report = backup.scrub();
+        CHECK_EQ(report.missing, size_t(1));
+        CHECK_EQ(report.repaired, size_t(1));
+        CHECK_EQ(report.unrepairable, size_t(0));
+        backup.restoreFile(file_id, "out/text.txt");
+    }
+    CHECK(readFile("out/text.txt") == std::vector<unsigned char>(text.begin(), text.end()));
+
+    // Without the stored form's digest a rebuild cannot be shown to match
+    // the original bytes, so the chunk is reported instead
+    execSql("backup.db", "UPDATE chunks SET compressed_checksum = NULL");
+    objects = storedObjects("chunk_0");
+    CHECK(!objects.empty());
+    fs::remove(objects[0]);
+    BackupSystem backup("backup.db", cfg);
+    ScrubReport report = backup.scrub();
+    CHECK_EQ(report.missing, size_t(1));
+    CHECK_EQ(report.repaired, size_t(0));
+    CHECK_EQ(report.unrepairable, size_t(1));
+}
+
+TEST(ScrubChecksEveryChunkAcrossBatches) {
+    PipelineConfig cfg = testConfig();
+    cfg.chunking = ChunkingMode::Fixed;
+    cfg.max_chunk_size = 4 * KiB;
+    size_t chunks = SCRUB_BATCH_CHUNKS + 44;
+    writeFile("src/a.bin", randomBytes(chunks * 4 * KiB, 12));
+    BackupSystem backup("backup.db", cfg);
+    backup.backupFile("src/a.bin");
+    ScrubOptions options = cfg.scrub;
+    options.threads = 3;
+    ScrubReport report = backup.scrub(options);
+    CHECK_EQ(report.chunks_checked, chunks);
+    CHECK_EQ(report.missing + report.corrupt, size_t(0));
+}
+
+TEST(KeyWrapAndCatalogRecovery) {
+    createMasterKey("master.key");
+    PipelineConfig cfg = testConfig();
+    cfg.master_key_path = "master.key";
+    cfg.catalog_replication = true;
+    std::vector<unsigned char> data = randomBytes(1 * MiB + 7, 7);
+    writeFile("src/a.bin", data);
+    int file_id = 0;
+    {
+        BackupSystem backup("backup.db", cfg);
+        file_id = backup.backupFile("src/a.bin");
+        backup.replicateCatalog();
+    }
+    CHECK(!fs::exists("backup.db-catalog")); // the snapshot copy is gone
+
+    // The file keys are useless without the master key
+    {
+        BackupSystem keyless("backup.db", testConfig());
+        CHECK_THROWS(keyless.restoreFile(file_id, "out/keyless.bin"));
+    }
+
+    fs::remove("backup.db");
+    fs::remove("backup.db-wal");
+    fs::remove("backup.db-shm");
+    CHECK(BackupSystem::recoverCatalog("backup.db", cfg) >= 1);
+    CHECK_THROWS(BackupSystem::recoverCatalog("backup.db", cfg)); // never overwrites
+    BackupSystem backup("backup.db", cfg);
+    backup.restoreFile(file_id, "out/a.bin");
+    CHECK(readFile("out/a.bin") == data);
+}
+
+// --- Failure paths ---
+
+TEST(DuplicatesFailWithTheirOwnerChunk) {
+    PipelineConfig cfg = testConfig();
+    cfg.dedup = true;
+    std::vector<unsigned char> data = randomBytes(3 * MiB, 8);
+    writeFile("src/a.bin", data);
+    writeFile("src/b.bin", data);
+    { BackupSystem create("backup.db", cfg); }
+    // Storing one owner chunk fails; the other file only references it
+    execSql("backup.db", "CREATE TRIGGER fail_owner BEFORE INSERT ON chunks "
+                         "WHEN NEW.chunk_index = 2 AND NEW.source_file_id IS NULL "
+                         "BEGIN SELECT RAISE(ABORT, 'injected'); END");
+    BackupSystem backup("backup.db", cfg);
+    std::shared_ptr<BackupHandle> a = backup.submitFile("src/a.bin");
+    std::shared_ptr<BackupHandle> b = backup.submitFile("src/b.bin");
+    CHECK_THROWS(a->wait());
+    CHECK_THROWS(b->wait());
+}
+
+// Descriptors this process holds on .partial files
+size_t openPartials() {
+    size_t count = 0;
+    for (const auto& entry : fs::directory_iterator("/proc/self/fd")) {
+        std::error_code error;
+        fs::path target = fs::read_symlink(entry.path(), error);
+        if (!error && target.extension() == ".partial") {
+            ++count;
+        }
+    }
+    return count;
+}
+
+TEST(FailedMultipartChunksCloseTheirParts) {
+    // Every part misses its deadline, so the chunk fails with its parts
+    // written; they are kept for a resume but their descriptor is closed
+    PipelineConfig cfg = testConfig();
+    cfg.provider_io = IoBackend::Uring;
+    cfg.upload_attempts = 1;
+    cfg.upload_hedging = false;
+    cfg.upload_timeout_ms = 1;
+    cfg.provider_latency_ms = 50;
+    cfg.part_size = 64 * KiB;
+    cfg.providers = {ProviderConfig{"Only", "./backup/only"}};
+    writeFile("src/a.bin", randomBytes(1 * MiB, 14));
+    BackupSystem backup("backup.db", cfg);
+    std::shared_ptr<BackupHandle> handle = backup.submitFile("src/a.bin");
+    CHECK_THROWS(handle->wait());
+    // Writes past their deadline hold the descriptor until they end
+    for (int i = 0; i < 200 && openPartials() > 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    CHECK_EQ(openPartials(), size_t(0));
+}
+
+TEST(FailedErasureCodedChunksLeaveNoShards) {
+    PipelineConfig cfg = testConfig();
+    cfg.distribution = DistributionMode::ErasureCoded;
+    cfg.upload_attempts = 1;
+    writeFile("src/a.bin", randomBytes(2 * MiB, 9));
+    BackupSystem backup("backup.db", cfg);
+    fs::remove_all(cfg.providers[2].path);
+    writeFile(cfg.providers[2].path, "not a directory");
+    CHECK_THROWS(backup.backupFile("src/a.bin"));
+    CHECK(storedObjects("shard").empty());
+}
+
+TEST(DirectoryRunThatStoresNothingFails) {
+    PipelineConfig cfg = testConfig();
+    cfg.upload_attempts = 1;
+    cfg.upload_hedging = false;
+    cfg.providers = {ProviderConfig{"Only", "./backup/only"}};
+    writeFile("tree/a.bin", randomBytes(1 * MiB, 10));
+    writeFile("tree/b.txt", "small");
+    BackupSystem backup("backup.db", cfg);
+    fs::remove_all("backup/only");
+    writeFile("backup/only", "not a directory");
+    std::string status;
+    CHECK_EQ(backup.backupDirectory("tree", BackupMode::Full, WalkOptions(), &status), 0);
+    CHECK_EQ(status, std::string("failed"));
+    std::vector<SnapshotRecord> snapshots = backup.listSnapshots();
+    CHECK_EQ(snapshots.size(), size_t(1));
+    CHECK_EQ(snapshots[0].status, std::string("failed"));
+    CHECK_EQ(backup.snapshotAt(std::time(nullptr) + 1), 0);
+}
+
+TEST(ManyPartsThroughOneTransferSlot) {
+    // Far more parts than a provider queues; submitters wait for room
+    PipelineConfig cfg = testConfig();
+    cfg.provider_transfers = 1;
+    cfg.part_size = 1 * KiB;
+    cfg.provider_latency_ms = 0;
+    std::vector<unsigned char> data = randomBytes(4 * MiB, 11);
+    writeFile("src/a.bin", data);
+    for (IoBackend io : {IoBackend::Blocking, IoBackend::Uring}) {
+        cfg.provider_io = io;
+        fs::remove_all("backup");
+        fs::remove_all("out");
+        BackupSystem backup("backup-" + std::to_string(static_cast<int>(io)) + ".db", cfg);
+        int file_id = backup.backupFile("src/a.bin");
+        backup.restoreFile(file_id, "out/a.bin");
+        CHECK(readFile("out/a.bin") == data);
+    }
+}
+
+TEST(WonHedgesMoveTheChunkAndItsDuplicates) {
+    // Ties place the first chunk on Slow; its duplicates are queued while
+    // it still uploads there, and the hedge to Fast wins
+    PipelineConfig cfg = testConfig();
+    cfg.providers = {ProviderConfig{"Slow", "./backup/slow", 0, 1500}, ProviderConfig{"Fast", "./backup/fast"}};
+    cfg.upload_hedging = true;
+    cfg.upload_hedge_min_ms = 50;
+    std::vector<unsigned char> block = randomBytes(1 * MiB, 12);
+    std::vector<unsigned char> data;
+    for (int i = 0; i < 3; ++i) {
+        data.insert(data.end(), block.begin(), block.end());
+    }
+    writeFile("src/a.bin", data);
+    {
+        BackupSystem backup("backup.db", cfg);
+        int file_id = backup.backupFile("src/a.bin");
+        CHECK(backup.metricsText().find("\nbackup_hedges_won_total 0\n") == std::string::npos);
+        backup.restoreFile(file_id, "out/a.bin");
+    }
+    CHECK(readFile("out/a.bin") == data);
+    CHECK(queryInt("backup.db", "SELECT COUNT(*) FROM chunks WHERE source_file_id IS NOT NULL") > 0);
+    CHECK_EQ(queryInt("backup.db", "SELECT COUNT(*) FROM chunks WHERE cloud_provider = 'Slow'"), int64_t(0));
+    CHECK_EQ(queryInt("backup.db", "SELECT COUNT(*) FROM content_index WHERE cloud_provider = 'Slow'"),
+             int64_t(0));
+}
+
+TEST(ExporterPortInUseFailsConstruction) {
+    int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(listener >= 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    CHECK_EQ(::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+    CHECK_EQ(::listen(listener, 1), 0);
+    socklen_t len = sizeof(addr);
+    CHECK_EQ(::getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &len), 0);
+
+    PipelineConfig cfg = testConfig();
+    cfg.metrics_port = ntohs(addr.sin_port);
+    cfg.background_scrub = true;
+    CHECK_THROWS(BackupSystem("backup.db", cfg));
+    ::close(listener);
+}
+
+} // namespace
+
+// Runs the named tests, or all of them, each in a scratch directory of
+// its own. Returns non-zero if any failed.
+int main(int argc, char** argv) {
+    std::vector<std::string> names(argv + 1, argv + argc);
+    int failed = 0;
+    int ran = 0;
+    fs::path original = fs::current_path();
+    for (const TestCase& test : testCases()) {
+        if (!names.empty() && std::find(names.begin(), names.end(), test.name) == names.end()) {
+            continue;
+        }
+        char pattern[] = "/tmp/backup_tests.XXXXXX";
+        if (!mkdtemp(pattern)) {
+            std::cerr << "Cannot create a scratch directory" << std::endl;
+            return 1;
+        }
+        fs::current_path(pattern);
+        ++ran;
+        try {
+            test.run();
+            std::cout << "PASS " << test.name << std::endl;
+        } catch (const std::exception& e) {
+            ++failed;
+            std::cout << "FAIL " << test.name << ": " << e.what() << std::endl;
+        }
+        fs::current_path(original);
+        std::error_code ec;
+        fs::remove_all(pattern, ec);
+    }
+    if (ran == 0) {
+        std::cerr << "No such test" << std::endl;
+        return 1;
+    }
+    return failed == 0 ? 0 : 1;
+}